@@ -22,6 +22,12 @@
 """
 Python TCP Client to receive streaming CSV data from Red Pitaya
 Usage: python3 tcp_client.py <red_pitaya_ip> [port] [output_file]
+
+Received events are acknowledged (ACK <seq>) twice a second. If the link drops
+(or stays silent for LINK_TIMEOUT seconds), the client reconnects and asks the
+Red Pitaya to resume after the last event it received (first CSV column, seq).
+Events recorded meanwhile are replayed from the on-board spool before live data
+continues.
 """
 
 import socket
@@ -30,6 +36,10 @@ import signal
 import time
 from datetime import datetime
 
+# The server sends an empty line every 2 s while it has no events and gives up on a send after 5 s,
+# so this much silence means the link is gone even if the OS has not noticed yet
+LINK_TIMEOUT = 10
+
 class TCPClient:
     def __init__(self, host, port=8888, output_file="unified_timestamps.csv"):
         self.host = host
@@ -38,6 +48,9 @@ class TCPClient:
         self.running = True
         self.sock = None
         self.file_handle = None
+        self.last_seq = None    # seq of the last event written to file
+        self.header_written = False
+        self.server_closed = False
         
         # Setup signal handler for graceful shutdown
         signal.signal(signal.SIGINT, self.signal_handler)
@@ -51,10 +64,22 @@ class TCPClient:
         """Connect to Red Pitaya"""
         try:
             self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self.sock.settimeout(5)
             print(f"Connecting to Red Pitaya at {self.host}:{self.port}...")
             self.sock.connect((self.host, self.port))
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_KEEPALIVE, 1)
+            self.sock.settimeout(1)     # wake up to acknowledge and to notice a silent link
+            # Tell the server where to continue: after our last event, or live for a new file
+            if self.last_seq is None:
+                self.sock.sendall(b"LIVE\n")
+            else:
+                self.sock.sendall(f"RESUME {self.last_seq}\n".encode())
             print("Connected successfully!")
             return True
+        except ConnectionRefusedError as e:
+            print(f"ERROR: Could not connect to Red Pitaya: {e}")
+            self.server_closed = True
+            return False
         except Exception as e:
             print(f"ERROR: Could not connect to Red Pitaya: {e}")
             return False
@@ -69,32 +94,70 @@ class TCPClient:
             print(f"ERROR: Could not open output file: {e}")
             return False
     
+    def write_lines(self, text_data):
+        """Write complete CSV lines, skipping repeated headers and events already received"""
+        lines = text_data.split('\n')
+        written = 0
+        for line in lines:
+            if not line:
+                continue
+            if line.startswith("seq,"):
+                if not self.header_written:
+                    self.file_handle.write(line + '\n')
+                    self.header_written = True
+                continue
+            seq = int(line.split(',', 1)[0])
+            if self.last_seq is not None and seq <= self.last_seq:
+                continue
+            self.file_handle.write(line + '\n')
+            self.last_seq = seq
+            written += 1
+        self.file_handle.flush()  # Ensure immediate write
+        return written
+
     def receive_data(self):
-        """Main data reception loop"""
+        """Main data reception loop, returns when the connection ends"""
         total_bytes = 0
         line_count = 0
         start_time = time.time()
         last_update = start_time
+        partial = ""
+        last_ack = start_time
+        acked_seq = None
+        last_data = start_time
         
         print("Press Ctrl+C to stop and close connection")
         
         try:
             while self.running:
+                # Acknowledge what is safely on disk, so the Red Pitaya does not need to spool it
+                if self.last_seq != acked_seq and time.time() - last_ack >= 0.5:
+                    self.sock.sendall(f"ACK {self.last_seq}\n".encode())
+                    acked_seq = self.last_seq
+                    last_ack = time.time()
+                
                 # Receive data
-                data = self.sock.recv(4096)
+                try:
+                    data = self.sock.recv(65536)
+                except socket.timeout:
+                    if time.time() - last_data >= LINK_TIMEOUT:
+                        print(f"\nNothing received for {LINK_TIMEOUT} s, link lost")
+                        break
+                    continue
+                last_data = time.time()
                 
                 if not data:
-                    print("Connection closed by Red Pitaya")
+                    print("\nConnection closed by Red Pitaya")
                     break
                 
-                # Decode and write to file
-                text_data = data.decode('utf-8', errors='ignore')
-                self.file_handle.write(text_data)
-                self.file_handle.flush()  # Ensure immediate write
+                # Decode and write complete lines to file
+                text_data = partial + data.decode('utf-8', errors='ignore')
+                cut = text_data.rfind('\n') + 1
+                partial = text_data[cut:]
                 
                 # Update statistics
                 total_bytes += len(data)
-                line_count += text_data.count('\n')
+                line_count += self.write_lines(text_data[:cut])
                 
                 # Print status update every second
                 current_time = time.time()
@@ -108,6 +171,13 @@ class TCPClient:
         except Exception as e:
             print(f"\nERROR during data reception: {e}")
         
+        # Last acknowledgment, whatever is not acknowledged stays in the Red Pitaya spool
+        try:
+            if self.last_seq != acked_seq:
+                self.sock.sendall(f"ACK {self.last_seq}\n".encode())
+        except OSError:
+            pass
+        
         # Final statistics
         elapsed = time.time() - start_time
         avg_rate = total_bytes / elapsed if elapsed > 0 else 0
@@ -123,7 +193,7 @@ class TCPClient:
         print(f"Data saved to: {self.output_file}")
     
     def run(self):
-        """Main execution function"""
+        """Main execution function, reconnects until stopped or the server is gone"""
         if not self.connect():
             return False
         
@@ -132,7 +202,15 @@ class TCPClient:
             return False
         
         try:
-            self.receive_data()
+            while self.running:
+                self.receive_data()
+                self.sock.close()
+                self.sock = None
+                # Reconnect and resume; a refused connection means the server has ended
+                while self.running and not self.server_closed and not self.connect():
+                    time.sleep(2)
+                if self.server_closed:
+                    break
         finally:
             self.cleanup()
         
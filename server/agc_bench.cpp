@@ -0,0 +1,127 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2025 TIFR
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Per-event processing cost of the amplitude to channel/bin mapping: runtime abs()+division
+// against the precomputed lookup tables. Runs on the board or on a PC, no FPGA needed.
+// Usage: ./agc_bench [step_alpha step_gamma]
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include "agc_kernel.h"
+
+using namespace std;
+
+#define N_EVENTS 4000000
+#define N_PARTNERS 4        //coincidence partners looked up per event
+
+struct ev{
+    int amp;
+    bool isalpha;
+};
+
+// one edge direction: times both mappings on the same events and compares spectra and bins element by element
+bool _run(bool falling, unsigned step_alpha, unsigned step_gamma)
+{
+    int alpha_thresh=falling?-600:600, gamma_thresh=alpha_thresh;
+    int alpha_max=falling?-8191:8191, gamma_max=alpha_max;
+
+    int ENmax_alpha=falling?-(alpha_max-alpha_thresh)+1:alpha_max-alpha_thresh+1;
+    int ENmax_gamma=falling?-(gamma_max-gamma_thresh)+1:gamma_max-gamma_thresh+1;
+    unsigned alpha_binN=ENmax_alpha/step_alpha+1;
+    unsigned gamma_binN=ENmax_gamma/step_gamma+1;
+    printf("%s edge:\n",falling?"Falling":"Rising");
+
+    vector<ev> evs(N_EVENTS);
+    srand(1);
+    for (int i=0;i!=N_EVENTS;i++){
+        evs[i].isalpha=rand()&1;
+        int dist=rand()%(falling?8193+alpha_thresh:8192-alpha_thresh);    //peaks past the threshold, up to the ADC limit
+        evs[i].amp=falling?alpha_thresh-dist:alpha_thresh+dist;
+    }
+
+    vector<unsigned> alpha_old(ENmax_alpha,0), gamma_old(ENmax_gamma,0), bins_old(alpha_binN*gamma_binN,0);
+    vector<unsigned> alpha_new(ENmax_alpha,0), gamma_new(ENmax_gamma,0), bins_new(alpha_binN*gamma_binN,0);
+
+    //####runtime abs() and division, as before
+    chrono::steady_clock::time_point t0=chrono::steady_clock::now();
+    for (int i=0;i!=N_EVENTS;i++){
+        int amplitude=evs[i].amp;
+        if (evs[i].isalpha){
+            if (abs(amplitude-alpha_thresh)<ENmax_alpha)
+                alpha_old[abs(amplitude-alpha_thresh)]++;
+        }else{
+            if (abs(amplitude-gamma_thresh)<ENmax_gamma)
+                gamma_old[abs(amplitude-gamma_thresh)]++;
+        }
+        for (int j=1;j<=N_PARTNERS&&j<=i;j++){
+            unsigned a,b;
+            a=abs(evs[i-j].amp-alpha_thresh)/step_alpha;
+            b=abs(amplitude-gamma_thresh)/step_gamma;
+            if ((a<alpha_binN)&&(b<gamma_binN)) bins_old[a*gamma_binN+b]++;
+        }
+    }
+    double t_old=chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+
+    //####lookup tables, partner bin cached with the peak
+    amp_lut *alpha_lut = new amp_lut;
+    amp_lut *gamma_lut = new amp_lut;
+    t0=chrono::steady_clock::now();
+    build_amp_lut(alpha_lut,alpha_thresh,falling,ENmax_alpha,step_alpha,alpha_binN);
+    build_amp_lut(gamma_lut,gamma_thresh,falling,ENmax_gamma,step_gamma,gamma_binN);
+    double t_build=chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+    vector<int> cached_bin(N_EVENTS);
+
+    t0=chrono::steady_clock::now();
+    for (int i=0;i!=N_EVENTS;i++){
+        int idx=amp_idx(evs[i].amp);
+        int chan;
+        if (evs[i].isalpha){
+            chan=alpha_lut->chan[idx];
+            if (chan>=0) alpha_new[chan]++;
+        }else{
+            chan=gamma_lut->chan[idx];
+            if (chan>=0) gamma_new[chan]++;
+        }
+        cached_bin[i]=alpha_lut->bin[idx];
+        int b=gamma_lut->bin[idx];
+        for (int j=1;j<=N_PARTNERS&&j<=i;j++){
+            int a=cached_bin[i-j];
+            if ((a>=0)&&(b>=0)) bins_new[a*gamma_binN+b]++;
+        }
+    }
+    double t_new=chrono::duration<double>(chrono::steady_clock::now()-t0).count();
+    delete alpha_lut;
+    delete gamma_lut;
+
+    bool match=(alpha_old==alpha_new)&&(gamma_old==gamma_new)&&(bins_old==bins_new);
+    printf("  abs()+division: %.2lf ns/event\n",t_old*1e9/N_EVENTS);
+    printf("  lookup table:   %.2lf ns/event (table build %.3lf ms, once at startup)\n",t_new*1e9/N_EVENTS,t_build*1e3);
+    printf("  speedup: %.2lfx, spectra and coincidence bins %s\n",t_old/t_new,match?"match":"DIFFER");
+    return match;
+}
+
+int main(int argc,char *argv[]){
+    unsigned step_alpha=100, step_gamma=128;
+    if (argc==3) {step_alpha=atoi(argv[1]); step_gamma=atoi(argv[2]);}
+    printf("step_alpha=%u step_gamma=%u, %d events, %d partners per event\n",step_alpha,step_gamma,N_EVENTS,N_PARTNERS);
+    bool match=_run(true,step_alpha,step_gamma);
+    match&=_run(false,step_alpha,step_gamma);
+    return match?0:1;
+}
@@ -0,0 +1,114 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2025 TIFR
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Sums the time sliced spectra written by agc_server over a time range, without touching raw events.
+// Usage: ./agc_extract <measurements dir>                     lists all slices
+//        ./agc_extract <measurements dir> <from> <to>         sums slices starting in [from, to)
+// from/to are in seconds since the start of the first slice. Output is alpha_range.dat and gamma_range.dat
+// in the measurements dir, same format as alpha.dat/gamma.dat.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <inttypes.h>
+#include "spectrum_ring.h"
+
+using namespace std;
+
+int main(int argc,char *argv[]){
+    if ((argc!=2)&&(argc!=4)){printf("Usage: %s <measurements dir> [<from> <to>] (seconds since first slice)\n",argv[0]);return 1;}
+    string dir=argv[1];
+
+    FILE* ifile;
+    ifile=fopen((dir+"/slices.idx").c_str(),"rb");
+    if (ifile==NULL){printf("Could not open %s/slices.idx\n",dir.c_str());return 1;}
+    vector<slice_idx> idx;
+    slice_idx tmp;
+    while (fread(&tmp,sizeof(slice_idx),1,ifile)==1) idx.push_back(tmp);
+    fclose(ifile);
+    if (idx.empty()){printf("No slices in %s/slices.idx\n",dir.c_str());return 1;}
+
+    double t_first=idx[0].run_t0+idx[0].t_start/125000000.0;
+    for (unsigned i=0;i!=idx.size();i++){
+        double t=idx[i].run_t0+idx[i].t_start/125000000.0;
+        if (t<t_first) t_first=t;
+    }
+
+    if (argc==2){
+        printf("slice\tstart(s)\tduration(s)\tN_alpha\tN_gamma\n");
+        for (unsigned i=0;i!=idx.size();i++)
+            printf("%u\t%.3lf\t%.3lf\t%" PRIu32"\t%" PRIu32"\n",i,idx[i].run_t0+idx[i].t_start/125000000.0-t_first,
+                   (idx[i].t_end-idx[i].t_start)/125000000.0,idx[i].n_alpha,idx[i].n_gamma);
+        return 0;
+    }
+
+    double from=atof(argv[2]);
+    double to=atof(argv[3]);
+    uint32_t ENmax_alpha=idx[0].ENmax_alpha;
+    uint32_t ENmax_gamma=idx[0].ENmax_gamma;
+    vector<uint32_t> alpha_array(ENmax_alpha,0);
+    vector<uint32_t> gamma_array(ENmax_gamma,0);
+    vector<uint32_t> pairs;
+
+    ifile=fopen((dir+"/slices.dat").c_str(),"rb");
+    if (ifile==NULL){printf("Could not open %s/slices.dat\n",dir.c_str());return 1;}
+    unsigned used=0;
+    double covered=0;
+    uint64_t N_alpha=0, N_gamma=0;
+    for (unsigned i=0;i!=idx.size();i++){
+        double t=idx[i].run_t0+idx[i].t_start/125000000.0-t_first;
+        double t_end=t+(idx[i].t_end-idx[i].t_start)/125000000.0;
+        if ((idx[i].n_alpha==0)&&(idx[i].n_gamma==0)){      //may span many slices, count only the part in range
+            double a=(t>from)?t:from, b=(t_end<to)?t_end:to;
+            if (b>a) covered+=b-a;
+            continue;
+        }
+        if ((t<from)||(t>=to)) continue;
+        if ((idx[i].ENmax_alpha!=ENmax_alpha)||(idx[i].ENmax_gamma!=ENmax_gamma)){
+            printf("Slice %u has different spectrum lengths (configuration changed). Aborting.\n",i);
+            fclose(ifile);
+            return 1;
+        }
+        pairs.resize(2*((size_t)idx[i].nz_alpha+idx[i].nz_gamma));
+        fseek(ifile,idx[i].offset,SEEK_SET);
+        if (fread(pairs.data(),sizeof(uint32_t),pairs.size(),ifile)!=pairs.size()){
+            printf("slices.dat is shorter than slices.idx says (slice %u). Aborting.\n",i);
+            fclose(ifile);
+            return 1;
+        }
+        for (uint32_t k=0;k!=idx[i].nz_alpha;k++) alpha_array[pairs[2*k]]+=pairs[2*k+1];
+        for (uint32_t k=idx[i].nz_alpha;k!=idx[i].nz_alpha+idx[i].nz_gamma;k++) gamma_array[pairs[2*k]]+=pairs[2*k+1];
+        N_alpha+=idx[i].n_alpha;
+        N_gamma+=idx[i].n_gamma;
+        covered+=(idx[i].t_end-idx[i].t_start)/125000000.0;
+        used++;
+    }
+    fclose(ifile);
+    printf("Summed %u slices, %.3lf s of acquisition. N_alpha=%" PRIu64" N_gamma=%" PRIu64"\n",used,covered,N_alpha,N_gamma);
+
+    FILE* ofile;
+    ofile=fopen((dir+"/alpha_range.dat").c_str(),"wb");
+    fwrite(alpha_array.data(),sizeof(uint32_t),ENmax_alpha,ofile);
+    fclose(ofile);
+    ofile=fopen((dir+"/gamma_range.dat").c_str(),"wb");
+    fwrite(gamma_array.data(),sizeof(uint32_t),ENmax_gamma,ofile);
+    fclose(ofile);
+    printf("Saved alpha_range.dat and gamma_range.dat, format is \'%%uint32\' starting from threshold(=0).\n");
+    return 0;
+}
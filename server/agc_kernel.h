@@ -0,0 +1,84 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2025 TIFR
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AGC_KERNEL_H
+#define AGC_KERNEL_H
+
+#include <stdint.h>
+
+#define ADC_MIN -8192
+#define ADC_N 16384        //14 bit signed ADC range, -8192 to 8191
+
+// Amplitude to channel/bin mapping for one input, precomputed over the whole ADC range once the
+// configuration is loaded. chan is the spectrum index (distance from threshold), bin is chan/step.
+// -1 marks amplitudes that fall outside the spectrum (chan) or the time resolved bins (bin).
+struct amp_lut{
+    int32_t chan[ADC_N];
+    int32_t bin[ADC_N];
+};
+
+inline int amp_idx(int amplitude) {return amplitude-ADC_MIN;}
+
+// step is a power of two: divide by shifting
+struct step_shift{
+    unsigned sh;
+    step_shift(unsigned step) {sh=0; while ((1u<<sh)<step) sh++;}
+    inline unsigned div(unsigned x) const {return x>>sh;}
+};
+
+// any other step: multiply by a precomputed reciprocal. Exact for x<2^15, which covers any
+// distance between two 14 bit values.
+struct step_recip{
+    uint64_t m;
+    step_recip(unsigned step) {m=((uint64_t)1<<32)/step+1;}
+    inline unsigned div(unsigned x) const {return (unsigned)((x*m)>>32);}
+};
+
+// distance from threshold in the direction of the trigger edge. The FPGA only reports peak
+// maxima past the threshold, so this is never negative for a real event.
+template <bool falling>
+inline int edge_chan(int amplitude, int thresh)
+{
+    return falling ? thresh-amplitude : amplitude-thresh;
+}
+
+template <bool falling, class Step>
+void _fill_amp_lut(amp_lut *lut, int thresh, int ENmax, unsigned binN, Step step)
+{
+    for (int i=0;i!=ADC_N;i++){
+        int c=edge_chan<falling>(i+ADC_MIN,thresh);
+        lut->chan[i]=((c>=0)&&(c<ENmax))?c:-1;
+        if (c<0) {lut->bin[i]=-1; continue;}
+        unsigned b=step.div((unsigned)c);
+        lut->bin[i]=(b<binN)?(int32_t)b:-1;
+    }
+}
+
+// pick the matching instantiation once, after _load_conf()
+inline void build_amp_lut(amp_lut *lut, int thresh, bool falling, int ENmax, unsigned step, unsigned binN)
+{
+    bool pow2=(step&(step-1))==0;
+    if (falling){
+        if (pow2) _fill_amp_lut<true>(lut,thresh,ENmax,binN,step_shift(step));
+        else _fill_amp_lut<true>(lut,thresh,ENmax,binN,step_recip(step));
+    }else{
+        if (pow2) _fill_amp_lut<false>(lut,thresh,ENmax,binN,step_shift(step));
+        else _fill_amp_lut<false>(lut,thresh,ENmax,binN,step_recip(step));
+    }
+}
+
+#endif
@@ -0,0 +1,368 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2025 TIFR
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Merges any number of measurements folders (alpha.dat, gamma.dat, time.dat, timesum.dat) recorded with
+// compatible configurations into a new one. Thresholds, edges, maxima and interval must match; time resolved
+// amplitude steps may differ by integer factors, time.dat is then rebinned to the coarsest step.
+// Counts are summed in 64 bit. time.dat files are processed one coarse alpha bin at a time, only that part of
+// each input is memory mapped, with the time axis split between threads, so they are never loaded whole.
+// Usage: ./agc_merge [-j threads] [--u64] <output dir> <measurements dir> <measurements dir> ...
+// --u64 writes '%uint64' files and adds "Count width (in bits): 64" to agc_conf.txt, else counts are written as
+// '%uint32' like agc_server, saturating on overflow. Inputs may be either.
+// Per folder totals (alpha, gamma, coincidences) are printed so runs can be compared before trusting the merge.
+
+#define _FILE_OFFSET_BITS 64        //time.dat may exceed 2 GB on the 32 bit board
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+
+using namespace std;
+
+struct agc_conf{
+    string dir;
+    string text;
+    int alpha_thresh;
+    char alpha_edge;
+    int alpha_max;
+    int gamma_thresh;
+    char gamma_edge;
+    int gamma_max;
+    double alpha_mintime;
+    double gamma_mintime;
+    double interval;
+    unsigned step_alpha;
+    unsigned step_gamma;
+    unsigned width;         //bytes per count, 8 for agc_merge --u64 output
+
+    int ENmax_alpha;
+    int ENmax_gamma;
+    unsigned alpha_binN;
+    unsigned gamma_binN;
+    unsigned interval_uint;
+};
+
+#define WIDTH_KEY "Count width (in bits):"       //only in folders written by agc_merge --u64
+
+// same keys as _load_conf() in agc_server.cpp
+bool _read_conf(agc_conf *c)
+{
+    ifstream t((c->dir+"/agc_conf.txt").c_str());
+    c->text=string((istreambuf_iterator<char>(t)), istreambuf_iterator<char>());
+    if (c->text.empty()) {printf("No agc_conf.txt in %s\n",c->dir.c_str()); return false;}
+    struct {const char *key; const char *fmt; void *val;} keys[]={
+        {"alpha_thresh(-8192 - 8191):"," %d",&c->alpha_thresh},
+        {"alpha_edge(Rising (R) or Falling (F)):"," %c",&c->alpha_edge},
+        {"alpha_max(R edge: alpha_thresh < x < 8191, F edge: -8192 < x < alpha_thresh):"," %d",&c->alpha_max},
+        {"gamma_thresh(-8192 - 8191):"," %d",&c->gamma_thresh},
+        {"gamma_edge(Rising (R) or Falling (F)):"," %c",&c->gamma_edge},
+        {"gamma_max(R edge: gamma_thresh < x < 8191, F edge: -8192 < x < gamma_thresh):"," %d",&c->gamma_max},
+        {"alpha_mintime(0 - 34.3597):"," %lf",&c->alpha_mintime},
+        {"gamma_mintime(0 - 34.3597):"," %lf",&c->gamma_mintime},
+        {"Observed interval before and after trigger event(0 - 34.3597)(in seconds):"," %lf",&c->interval},
+        {"Time resolved alpha amplitude step:"," %u",&c->step_alpha},
+        {"Time resolved gamma amplitude step:"," %u",&c->step_gamma},
+    };
+    for (unsigned i=0;i!=sizeof(keys)/sizeof(keys[0]);i++){
+        size_t pos=c->text.find(keys[i].key);
+        if ((pos==string::npos)||(sscanf(c->text.c_str()+pos+strlen(keys[i].key),keys[i].fmt,keys[i].val)!=1))
+            {printf("Error in %s/agc_conf.txt at \"%s\"\n",c->dir.c_str(),keys[i].key); return false;}
+    }
+    if ((c->step_alpha==0)||(c->step_gamma==0)) {printf("Zero amplitude step in %s/agc_conf.txt\n",c->dir.c_str()); return false;}
+    unsigned bits=32;
+    size_t pos=c->text.find(WIDTH_KEY);
+    if ((pos!=string::npos)&&((sscanf(c->text.c_str()+pos+strlen(WIDTH_KEY)," %u",&bits)!=1)||((bits!=32)&&(bits!=64))))
+        {printf("Error in %s/agc_conf.txt at \"%s\"\n",c->dir.c_str(),WIDTH_KEY); return false;}
+    c->width=bits/8;
+    c->ENmax_alpha=(c->alpha_edge=='R')?c->alpha_max-c->alpha_thresh+1:-(c->alpha_max-c->alpha_thresh)+1;
+    c->ENmax_gamma=(c->gamma_edge=='R')?c->gamma_max-c->gamma_thresh+1:-(c->gamma_max-c->gamma_thresh)+1;
+    c->alpha_binN=c->ENmax_alpha/c->step_alpha+1;
+    c->gamma_binN=c->ENmax_gamma/c->step_gamma+1;
+    c->interval_uint=(unsigned)(c->interval*125000000);
+    return true;
+}
+
+// .dat file checked against the expected number of counts, mapped read only one window at a time
+struct dat_map{
+    int fd;
+    unsigned width;         //bytes per count
+    void *base;             //current mapping, starts on a page boundary
+    size_t maplen;
+    const char *data;       //first count of the window
+};
+
+bool _open_dat(dat_map *m, const string& fname, uint64_t count, unsigned width)
+{
+    m->base=NULL; m->width=width;
+    m->fd=open(fname.c_str(),O_RDONLY);
+    if (m->fd<0) {printf("open(%s) failed: %s\n",fname.c_str(),strerror(errno)); return false;}
+    struct stat st;
+    if (fstat(m->fd,&st)) {printf("fstat(%s) failed: %s\n",fname.c_str(),strerror(errno)); close(m->fd); return false;}
+    if ((uint64_t)st.st_size!=count*width){
+        printf("%s is %lld bytes, expected %" PRIu64" (%u bit counts) from its agc_conf.txt\n",
+               fname.c_str(),(long long)st.st_size,count*width,width*8);
+        close(m->fd); return false;
+    }
+    return true;
+}
+
+// maps counts [first, first+n)
+bool _map_window(dat_map *m, const string& fname, uint64_t first, uint64_t n)
+{
+    m->base=NULL; m->data=NULL;
+    if (n==0) return true;
+    static const uint64_t page=sysconf(_SC_PAGESIZE);
+    uint64_t offset=first*m->width;
+    uint64_t start=offset-offset%page;
+    m->maplen=offset-start+n*m->width;
+    void *p=mmap(NULL,m->maplen,PROT_READ,MAP_SHARED,m->fd,(off_t)start);
+    if (p==MAP_FAILED) {printf("mmap(%s) failed: %s\n",fname.c_str(),strerror(errno)); return false;}
+    madvise(p,m->maplen,MADV_SEQUENTIAL);
+    m->base=p;
+    m->data=(const char *)p+(offset-start);
+    return true;
+}
+
+void _unmap_window(dat_map *m)
+{
+    if (m->base) munmap(m->base,m->maplen);
+    m->base=NULL;
+}
+
+void _close_dat(dat_map *m)
+{
+    _unmap_window(m);
+    close(m->fd);
+}
+
+// widening add, written so the compiler vectorizes it at -O3 (SSE/AVX on a PC, NEON on the board with
+// the -mfpu=neon flag CMakeLists.txt adds for 32 bit ARM)
+template <class T>
+inline void _add_counts(uint64_t *__restrict acc, const T *__restrict src, size_t n)
+{
+    for (size_t k=0;k!=n;k++) acc[k]+=src[k];
+}
+
+// n counts of width bytes each starting at src
+inline void _add_dat(uint64_t *acc, const char *src, unsigned width, size_t n)
+{
+    if (width==8) _add_counts(acc,(const uint64_t *)src,n);
+    else _add_counts(acc,(const uint32_t *)src,n);
+}
+
+bool u64=false;
+uint64_t saturated=0;
+
+void _write_counts(FILE *ofile, const uint64_t *acc, size_t n)
+{
+    if (u64) {fwrite(acc,sizeof(uint64_t),n,ofile); return;}
+    vector<uint32_t> out(n);
+    for (size_t k=0;k!=n;k++){
+        if (acc[k]>UINT32_MAX) {out[k]=UINT32_MAX; saturated++;}
+        else out[k]=(uint32_t)acc[k];
+    }
+    fwrite(out.data(),sizeof(uint32_t),n,ofile);
+}
+
+// sum 1D spectra (alpha.dat, gamma.dat, timesum.dat) from all inputs, totals[i] gets the counts in input i
+bool _merge_1d(const vector<agc_conf>& confs, const string& outdir, const char *name, size_t n, vector<uint64_t> *totals)
+{
+    vector<uint64_t> acc(n,0);
+    totals->assign(confs.size(),0);
+    vector<uint64_t> one(n);
+    for (unsigned i=0;i!=confs.size();i++){
+        dat_map m;
+        string fname=confs[i].dir+"/"+name;
+        if (!_open_dat(&m,fname,n,confs[i].width)) return false;
+        if (!_map_window(&m,fname,0,n)) {_close_dat(&m); return false;}
+        fill(one.begin(),one.end(),0);
+        if (n) _add_dat(one.data(),m.data,m.width,n);
+        _close_dat(&m);
+        for (size_t k=0;k!=n;k++) {(*totals)[i]+=one[k]; acc[k]+=one[k];}
+    }
+    FILE *ofile=fopen((outdir+"/"+name).c_str(),"wb");
+    if (ofile==NULL) {printf("Could not write %s/%s\n",outdir.c_str(),name); return false;}
+    _write_counts(ofile,acc.data(),n);
+    fclose(ofile);
+    return true;
+}
+
+// fine alpha bins of input c falling into coarse alpha bin ca: [*a0, *a1)
+void _fine_bins(const agc_conf& c, unsigned ca, unsigned step_alpha, unsigned *a0, unsigned *a1)
+{
+    unsigned fa=step_alpha/c.step_alpha;
+    *a0=min(ca*fa,c.alpha_binN);
+    *a1=min((ca+1)*fa,c.alpha_binN);
+}
+
+// add time.dat rows of fine bins falling into coarse alpha bin ca, for time steps [k0,k1). maps[i] holds
+// the window of input i starting at its first fine bin.
+void _merge_time_part(const vector<agc_conf>& confs, const vector<dat_map>& maps, unsigned ca,
+                      unsigned step_alpha, unsigned step_gamma, uint64_t *slab, size_t k0, size_t k1)
+{
+    for (unsigned i=0;i!=confs.size();i++){
+        const agc_conf &c=confs[i];
+        size_t row=2*(size_t)c.interval_uint;
+        unsigned fg=step_gamma/c.step_gamma;
+        unsigned a0, a1;
+        _fine_bins(c,ca,step_alpha,&a0,&a1);
+        for (unsigned a=a0;a!=a1;a++){
+            for (unsigned b=0;b!=c.gamma_binN;b++){
+                const char *src=maps[i].data+(((size_t)(a-a0)*c.gamma_binN+b)*row+k0)*maps[i].width;
+                _add_dat(slab+(b/fg)*row+k0,src,maps[i].width,k1-k0);
+            }
+        }
+    }
+}
+
+int main(int argc,char *argv[]){
+    unsigned nthreads=thread::hardware_concurrency();
+    if (nthreads==0) nthreads=1;
+    int argi=1;
+    for (;argi<argc&&argv[argi][0]=='-';argi++){
+        if (!strcmp(argv[argi],"-j")&&(argi+1<argc)) nthreads=atoi(argv[++argi]);
+        else if (!strcmp(argv[argi],"--u64")) u64=true;
+        else break;
+    }
+    if ((argc-argi<3)||(nthreads==0)){
+        printf("Usage: %s [-j threads] [--u64] <output dir> <measurements dir> <measurements dir> ...\n",argv[0]);
+        return 1;
+    }
+    string outdir=argv[argi++];
+
+    vector<agc_conf> confs(argc-argi);
+    for (unsigned i=0;i!=confs.size();i++){
+        confs[i].dir=argv[argi+i];
+        if (!_read_conf(&confs[i])) return 1;
+    }
+
+    //inputs stay mapped while outputs are written, so the output folder must not be one of them
+    char outreal[PATH_MAX], inreal[PATH_MAX];
+    if (realpath(outdir.c_str(),outreal)!=NULL){
+        for (unsigned i=0;i!=confs.size();i++){
+            if ((realpath(confs[i].dir.c_str(),inreal)!=NULL)&&!strcmp(outreal,inreal)){
+                printf("Output folder %s is also an input. Merge into a new folder.\n",outdir.c_str());
+                return 1;
+            }
+        }
+    }
+
+    //####check compatibility, pick coarsest steps
+    const agc_conf &c0=confs[0];
+    unsigned step_alpha=0, step_gamma=0;
+    for (unsigned i=0;i!=confs.size();i++){
+        const agc_conf &c=confs[i];
+        if ((c.alpha_thresh!=c0.alpha_thresh)||(c.alpha_edge!=c0.alpha_edge)||(c.alpha_max!=c0.alpha_max)||
+            (c.gamma_thresh!=c0.gamma_thresh)||(c.gamma_edge!=c0.gamma_edge)||(c.gamma_max!=c0.gamma_max)||
+            (c.interval_uint!=c0.interval_uint)){
+            printf("%s: thresholds, edges, maxima or interval differ from %s. Cannot merge.\n",c.dir.c_str(),c0.dir.c_str());
+            return 1;
+        }
+        if ((c.alpha_mintime!=c0.alpha_mintime)||(c.gamma_mintime!=c0.gamma_mintime))
+            printf("WARNING: %s: mintimes differ from %s, spectra are merged anyway.\n",c.dir.c_str(),c0.dir.c_str());
+        if (c.step_alpha>step_alpha) step_alpha=c.step_alpha;
+        if (c.step_gamma>step_gamma) step_gamma=c.step_gamma;
+    }
+    for (unsigned i=0;i!=confs.size();i++){
+        if ((step_alpha%confs[i].step_alpha)||(step_gamma%confs[i].step_gamma)){
+            printf("%s: amplitude steps %u/%u are not integer fractions of %u/%u. Cannot rebin.\n",
+                   confs[i].dir.c_str(),confs[i].step_alpha,confs[i].step_gamma,step_alpha,step_gamma);
+            return 1;
+        }
+    }
+    unsigned alpha_binN=c0.ENmax_alpha/step_alpha+1;
+    unsigned gamma_binN=c0.ENmax_gamma/step_gamma+1;
+    size_t row=2*(size_t)c0.interval_uint;
+    printf("Merging %zu folders into %s, %u threads. Steps %u/%u, time.dat is %u:%u:%zu.\n",
+           confs.size(),outdir.c_str(),nthreads,step_alpha,step_gamma,alpha_binN,gamma_binN,row);
+
+    string command="mkdir -p "+outdir;
+    system(command.c_str());
+
+    vector<uint64_t> N_alpha, N_gamma, N_coinc;
+    if (!_merge_1d(confs,outdir,"alpha.dat",c0.ENmax_alpha,&N_alpha)) return 1;
+    if (!_merge_1d(confs,outdir,"gamma.dat",c0.ENmax_gamma,&N_gamma)) return 1;
+    if (!_merge_1d(confs,outdir,"timesum.dat",row,&N_coinc)) return 1;
+    printf("folder\tsteps\talpha counts\tgamma counts\tcoincidences\n");
+    for (unsigned i=0;i!=confs.size();i++)
+        printf("%s\t%u/%u\t%" PRIu64"\t%" PRIu64"\t%" PRIu64"\n",confs[i].dir.c_str(),confs[i].step_alpha,confs[i].step_gamma,N_alpha[i],N_gamma[i],N_coinc[i]);
+
+    //####time.dat, one coarse alpha bin (slab) at a time, only its rows of each input are mapped
+    vector<dat_map> maps(confs.size());
+    vector<string> names(confs.size());
+    for (unsigned i=0;i!=confs.size();i++){
+        names[i]=confs[i].dir+"/time.dat";
+        if (!_open_dat(&maps[i],names[i],(uint64_t)confs[i].alpha_binN*confs[i].gamma_binN*row,confs[i].width)) return 1;
+    }
+    FILE *ofile=fopen((outdir+"/time.dat").c_str(),"wb");
+    if (ofile==NULL) {printf("Could not write %s/time.dat\n",outdir.c_str()); return 1;}
+    vector<uint64_t> slab(gamma_binN*row);
+    size_t part=(row+nthreads-1)/nthreads;
+    for (unsigned ca=0;ca!=alpha_binN;ca++){
+        for (unsigned i=0;i!=confs.size();i++){
+            unsigned a0, a1;
+            _fine_bins(confs[i],ca,step_alpha,&a0,&a1);
+            if (!_map_window(&maps[i],names[i],(uint64_t)a0*confs[i].gamma_binN*row,(uint64_t)(a1-a0)*confs[i].gamma_binN*row))
+                return 1;
+        }
+        fill(slab.begin(),slab.end(),0);
+        vector<thread> workers;
+        for (unsigned t=0;t!=nthreads&&t*part<row;t++)
+            workers.push_back(thread(_merge_time_part,cref(confs),cref(maps),ca,step_alpha,step_gamma,slab.data(),t*part,min(row,(t+1)*part)));
+        for (unsigned t=0;t!=workers.size();t++) workers[t].join();
+        for (unsigned i=0;i!=confs.size();i++) _unmap_window(&maps[i]);
+        _write_counts(ofile,slab.data(),slab.size());
+    }
+    fclose(ofile);
+    for (unsigned i=0;i!=maps.size();i++) _close_dat(&maps[i]);
+
+    //####config with the merged steps, and total duration
+    string conf=c0.text;
+    const char *stepkeys[2]={"Time resolved alpha amplitude step:","Time resolved gamma amplitude step:"};
+    unsigned steps[2]={step_alpha,step_gamma};
+    for (int i=0;i!=2;i++){
+        size_t pos=conf.find(stepkeys[i])+strlen(stepkeys[i]);
+        size_t end=conf.find('\n',pos);
+        conf.replace(pos,end-pos,"\t"+to_string(steps[i]));
+    }
+    size_t pos=conf.find(WIDTH_KEY);
+    if (pos!=string::npos) conf.erase(pos,conf.find('\n',pos)+1-pos);
+    if (u64) conf+=string((conf.empty()||conf[conf.size()-1]=='\n')?"":"\n")+WIDTH_KEY "\t64\n";
+    ofstream((outdir+"/agc_conf.txt").c_str()) << conf;
+    ofstream duration((outdir+"/duration.txt").c_str());
+    for (unsigned i=0;i!=confs.size();i++){
+        ifstream t((confs[i].dir+"/duration.txt").c_str());
+        if (t.is_open()&&(t.peek()!=EOF)) duration << t.rdbuf();
+    }
+
+    if (saturated) printf("WARNING: %" PRIu64" counts exceeded 32 bit and were saturated. Rerun with --u64.\n",saturated);
+    printf("done! format is \'%%uint%d\', time.dat is a 3D matrix of size %u:%u:%zu.\n",u64?64:32,alpha_binN,gamma_binN,row);
+    return 0;
+}
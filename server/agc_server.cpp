@@ -20,11 +20,15 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <fstream>
 #include <deque>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ctime>
 #include <algorithm>
 #include <inttypes.h>
 #include <iomanip>
@@ -33,8 +37,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <poll.h>
 #include <errno.h>
 #include "fpga.cpp"
+#include "agc_kernel.h"
+#include "spectrum_ring.h"
+#include "event_spool.h"
 
 using namespace std;
 
@@ -42,13 +50,24 @@ using namespace std;
 int server_socket = -1;
 int client_socket = -1;
 mutex tcp_mutex;
-bool tcp_connected = false;
+atomic<bool> tcp_connected(false);
 string pc_ip_address = "192.168.1.100"; // Default PC IP - modify as needed
 int tcp_port = 1234; // Default port - modify as needed
 
+// Store-and-forward: every event goes through the spool, the sender thread streams it to the PC
+event_spool spool;
+string spool_dir = "spool";
+unsigned spool_mb = 256;
+atomic<bool> tcp_stop(false);
+atomic<uint64_t> tcp_cursor(0);         // next event to send
+bool tcp_resumed = false;               // the last client connected with RESUME
+atomic<uint64_t> catchup_events(0);     // events sent while behind live, and the time it took
+atomic<uint64_t> catchup_us(0);
+
 struct peak{
     uint64_t time;
     int amp;
+    int bin;    //time resolved amplitude bin, -1 if out of range
     bool isalpha;
 };
 
@@ -67,6 +86,8 @@ unsigned step_alpha;
 unsigned step_gamma;
 int alpha_max;
 int gamma_max;
+double slice_time;
+uint64_t slice_uint;
 
 bool sortfun (peak a,peak b) {
     if (a.time==b.time) {
@@ -119,24 +140,137 @@ bool accept_tcp_connection() {
     }
     
     printf("TCP connection established with %s\n", inet_ntoa(client_addr.sin_addr));
+    
+    // A client may send "RESUME <last seq received>\n" right after connecting to catch up from the spool,
+    // anything else (or nothing within 1 s) starts it at live events. While connected it sends "ACK <seq>\n"
+    // now and then; events it has not acknowledged are spooled when they leave memory. An empty line is sent
+    // every 2 s without events, so the client can tell an idle link from a dead one.
+    struct timeval tv = {1, 0};
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char request[64];
+    unsigned long long last_seq;
+    ssize_t n = recv(client_socket, request, sizeof(request)-1, 0);
+    uint64_t cursor = spool.head();
+    tcp_resumed = false;
+    if (n > 0) {
+        request[n] = 0;
+        if (sscanf(request, "RESUME %llu", &last_seq) == 1 && last_seq < cursor) {
+            cursor = last_seq+1;
+            tcp_resumed = true;
+        }
+    }
+    tcp_cursor = cursor;
+    printf("Streaming from event %" PRIu64" (live is %" PRIu64")\n", cursor, spool.head());
+    
+    // A stalled link fails the send after 5 s instead of blocking the sender forever
+    tv.tv_sec = 5;
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
     tcp_connected = true;
     
     // Send CSV header
-    string header = "time_alpha,amp_alpha,time_gamma,amp_gamma\n";
-    send(client_socket, header.c_str(), header.length(), 0);
+    string header = "seq,time_alpha,amp_alpha,time_gamma,amp_gamma\n";
+    send(client_socket, header.c_str(), header.length(), MSG_NOSIGNAL);
     
     return true;
 }
 
-void send_tcp_data(const string& data) {
+bool send_tcp_data(const char* data, size_t len) {
     lock_guard<mutex> guard(tcp_mutex);
-    if (tcp_connected && client_socket >= 0) {
-        ssize_t bytes_sent = send(client_socket, data.c_str(), data.length(), MSG_NOSIGNAL);
+    while (tcp_connected && client_socket >= 0 && len) {
+        ssize_t bytes_sent = send(client_socket, data, len, MSG_NOSIGNAL);
         if (bytes_sent < 0) {
-            printf("WARNING: TCP send failed, connection may be lost\n");
+            if (errno == EINTR) continue;
+            printf("WARNING: TCP send failed, connection may be lost. Events are spooled until the PC reconnects.\n");
+            close(client_socket);
+            client_socket = -1;
             tcp_connected = false;
+            return false;
+        }
+        data += bytes_sent;
+        len -= bytes_sent;
+    }
+    return tcp_connected;
+}
+
+// Sender thread: streams events from the spool, accepts reconnects. Only this thread blocks on the network.
+void tcp_fun(void) {
+    spool_rec *recs = new spool_rec[SPOOL_CHUNK_EVENTS];
+    char *csv = new char[SPOOL_CHUNK_EVENTS*64];
+    bool client_acks = false;       // clients that never ACK count as acknowledged once sent
+    string acks;
+    // a connection can only acknowledge what it was sent: [conn_start, conn_sent). Events before a LIVE start
+    // stay unacknowledged in the spool.
+    uint64_t conn_start = tcp_cursor, conn_sent = conn_start, conn_acked = conn_start;
+    chrono::steady_clock::time_point last_send = chrono::steady_clock::now();
+    chrono::steady_clock::time_point drained;       // when everything was sent after tcp_stop
+    bool draining = false;
+    for (;;) {
+        if (!tcp_connected) {
+            if (tcp_stop) break;
+            struct pollfd pfd = {server_socket, POLLIN, 0};
+            if (poll(&pfd, 1, 200) <= 0) continue;
+            if (!accept_tcp_connection()) continue;
+            // RESUME also tells how much of what the previous connection sent has arrived
+            if (tcp_resumed && tcp_cursor > conn_acked && tcp_cursor <= conn_sent) spool.ack(conn_start, tcp_cursor);
+            client_acks = false;
+            acks.clear();
+            conn_start = conn_sent = conn_acked = tcp_cursor;
+            last_send = chrono::steady_clock::now();
+        }
+        
+        char ackbuf[256];
+        ssize_t r;
+        while ((r = recv(client_socket, ackbuf, sizeof(ackbuf), MSG_DONTWAIT)) > 0) acks.append(ackbuf, r);
+        size_t eol;
+        while ((eol = acks.find('\n')) != string::npos) {
+            unsigned long long acked;
+            if (sscanf(acks.c_str(), "ACK %llu", &acked) == 1) {
+                client_acks = true;
+                if (acked+1 > conn_acked && acked+1 <= conn_sent) {     // ignore ACKs going back or past what was sent
+                    conn_acked = acked+1;
+                    spool.ack(conn_start, conn_acked);
+                }
+            }
+            acks.erase(0, eol+1);
+        }
+        
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        uint64_t cursor = tcp_cursor;     // moved past events that were dropped, spool.lost counts them
+        uint64_t head = spool.head();
+        unsigned n = spool.read(&cursor, recs, SPOOL_CHUNK_EVENTS);
+        if (n == 0) {
+            if (tcp_stop) {
+                // everything sent; give the client a moment to acknowledge the last events, or they get spooled
+                if (!client_acks || conn_acked >= head) break;
+                if (!draining) {draining = true; drained = t0;}
+                if (t0-drained > chrono::seconds(3)) break;
+            }
+            // an empty line every 2 s tells the client an idle link is still alive
+            if (t0-last_send > chrono::seconds(2)) {
+                send_tcp_data("\n", 1);
+                last_send = t0;
+            }
+            usleep(1000);
+            continue;
+        }
+        
+        size_t len = 0;
+        for (unsigned k = 0; k != n; k++) len += spool_csv(csv+len, cursor+k, &recs[k]);
+        
+        if (!send_tcp_data(csv, len)) continue;
+        last_send = chrono::steady_clock::now();
+        if (head-cursor > n) {      // more than this batch was waiting: catching up
+            catchup_events += n;
+            catchup_us += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-t0).count();
+        }
+        tcp_cursor = conn_sent = cursor+n;
+        if (!client_acks) {
+            conn_acked = conn_sent;
+            spool.ack(conn_start, conn_acked);
         }
     }
+    delete[] recs;
+    delete[] csv;
 }
 
 void cleanup_tcp() {
@@ -172,6 +306,9 @@ void _gen_conf(void)
         "Time resolved alpha amplitude step:\t100000\n"
         "Time resolved gamma amplitude step:\t100000\n"
         "TCP streaming port (1024-65535):\t1234\n"
+        "Spool directory for unsent events (SD card or tmpfs):\tspool\n"
+        "Spool size limit (in MB):\t256\n"
+        "Spectrum time slice (0 = off)(in seconds):\t60\n"
         );
     fclose(conffile);
 }
@@ -269,6 +406,35 @@ void _load_conf(bool pf)
                 tcp_port = 1234; // Default port if not found in config
                 if(pf)printf("tcp_port=%d (default)\n",tcp_port);
             }
+        
+        size_t pos_spool_dir = conffile.find("Spool directory for unsent events (SD card or tmpfs):");
+            if (pos_spool_dir != string::npos){
+                pos_spool_dir+=53;
+                char tmpdir[256];
+                sscanf(conffile.substr(pos_spool_dir).c_str(), "%255s", tmpdir);
+                spool_dir = tmpdir;
+                if(pf)printf("spool_dir=%s\n",spool_dir.c_str());
+            }else {
+                if(pf)printf("spool_dir=%s (default)\n",spool_dir.c_str());
+            }
+        size_t pos_spool_mb = conffile.find("Spool size limit (in MB):");
+            if (pos_spool_mb != string::npos){
+                pos_spool_mb+=25;
+                sscanf(conffile.substr(pos_spool_mb).c_str(), "%u", &spool_mb);
+                if(pf)printf("spool_mb=%u\n",spool_mb);
+            }else {
+                if(pf)printf("spool_mb=%u (default)\n",spool_mb);
+            }
+        
+        size_t pos_slice_time = conffile.find("Spectrum time slice (0 = off)(in seconds):");
+            if (pos_slice_time != string::npos){
+                pos_slice_time+=42;
+                sscanf(conffile.substr(pos_slice_time).c_str(), "%lf", &slice_time);
+                if(pf)printf("slice_time=%lf\n",slice_time);
+            }else {
+                slice_time = 0; // Off if not found in config, older configs
+                if(pf)printf("slice_time=%lf (off)\n",slice_time);
+            }
             
         if(pf)printf("All loaded, no errors (I did not check for boundaries, you better had chosen them properly)!.\n");
     }
@@ -280,6 +446,26 @@ void _load_conf(bool pf)
     t.close();
 }
 
+// settings that do not change what is accumulated in measurements/, they may differ between runs
+const char *runtime_keys[] = {
+    "Spool directory for unsent events (SD card or tmpfs):",
+    "Spool size limit (in MB):",
+    "Spectrum time slice (0 = off)(in seconds):",
+};
+
+string _strip_runtime(const string& conffile)
+{
+    istringstream in(conffile);
+    string line, out;
+    while (getline(in, line)) {
+        bool runtime = false;
+        for (unsigned i = 0; i != sizeof(runtime_keys)/sizeof(runtime_keys[0]); i++)
+            if (line.compare(0, strlen(runtime_keys[i]), runtime_keys[i]) == 0) runtime = true;
+        if (!runtime) out += line+"\n";
+    }
+    return out;
+}
+
 bool _match_confs()    //compare configs
 {
     ifstream t0("agc_conf.txt");
@@ -289,10 +475,20 @@ bool _match_confs()    //compare configs
     if (conffile2.empty()){
         system ("cp agc_conf.txt measurements/agc_conf.txt");
     }
-    else if (conffile0.compare(conffile2) != 0) return true;
+    else if (_strip_runtime(conffile0).compare(_strip_runtime(conffile2)) != 0) return true;
     return false;
 }
 
+bool _wide_counts()    //folder written by agc_merge --u64
+{
+    ifstream t("measurements/agc_conf.txt");
+    string conffile((istreambuf_iterator<char>(t)), istreambuf_iterator<char>());
+    size_t pos = conffile.find("Count width (in bits):");
+    unsigned bits = 32;
+    if (pos != string::npos) sscanf(conffile.c_str()+pos+22, " %u", &bits);
+    return bits != 32;
+}
+
 mutex endack_mx;
 bool endack=false;
 void term_fun(void){
@@ -320,6 +516,7 @@ int main(int argc,char *argv[]){
     alpha_mintime_uint=(unsigned)(alpha_mintime*125000000);
     gamma_mintime_uint=(unsigned)(gamma_mintime*125000000);
     interval_uint=(unsigned)(interval*125000000);
+    slice_uint=(uint64_t)(slice_time*125000000);
 
     // Setup TCP server for streaming to PC
     if (!setup_tcp_server()) {
@@ -341,6 +538,8 @@ int main(int argc,char *argv[]){
     
     //make measurements folder if missing, and check if existing configuration inside it matches the config in the working directory
     system ("mkdir measurements -p");
+    if (_wide_counts()) {printf ("measurements folder holds 64 bit counts written by agc_merge --u64, this program adds 32 bit counts. "
+            "Start a new measurements folder. Aborting.\n");return 0;}
     if (_match_confs()) {printf ("Configuration in working directory does not match the one in measurements folder. "
             "You should rename the measurements folder to prevent appending new data with different configuration. Aborting.\n");return 0;}
     
@@ -361,6 +560,11 @@ int main(int argc,char *argv[]){
     unsigned gamma_binN = ENmax_gamma/step_gamma+1;
     if(pf)printf("gamma_binN=%u\n\n",gamma_binN);
     
+    amp_lut *alpha_lut = new amp_lut;
+    amp_lut *gamma_lut = new amp_lut;
+    build_amp_lut(alpha_lut,alpha_thresh,alpha_edge,ENmax_alpha,step_alpha,alpha_binN);
+    build_amp_lut(gamma_lut,gamma_thresh,gamma_edge,ENmax_gamma,step_gamma,gamma_binN);
+    
     long unsigned memreq;
     memreq=ENmax_alpha+ENmax_gamma+alpha_binN*gamma_binN*2*interval_uint;
     memreq*=sizeof(unsigned);
@@ -369,16 +573,25 @@ int main(int argc,char *argv[]){
         scanf("%*c");
     }
     
+    if (!spool.init(spool_dir,(uint64_t)spool_mb*1024*1024)) {
+        printf("ERROR: Could not create spool directory %s!\n",spool_dir.c_str());
+        cleanup_tcp();
+        return 1;
+    }
+    
     // Wait for TCP connection before starting acquisition
     if (!accept_tcp_connection()) {
         printf("ERROR: Could not establish TCP connection with PC!\n");
+        spool.finish();
         cleanup_tcp();
         return 1;
     }
     
-    if (AGC_init()) return -1;        //fpga init
+    if (AGC_init()) {spool.finish(); cleanup_tcp(); return -1;}        //fpga init
     AGC_setup(alpha_thresh,gamma_thresh,alpha_edge,gamma_edge,alpha_mintime_uint,gamma_mintime_uint);
     
+    thread tcp_thread (tcp_fun);            //streams from the spool, takes over reconnects
+    
     if(pf){
         thread term_thread (term_fun);            //ending by button
         term_thread.detach();            
@@ -420,7 +633,6 @@ int main(int argc,char *argv[]){
     uint64_t N_alpha=0;
     uint64_t N_gamma=0;
     uint64_t timestamp=0;
-    double time_in_seconds;
     
     deque <peak> active_trig_alpha;
     deque <peak> active_trig_gamma;
@@ -429,28 +641,21 @@ int main(int argc,char *argv[]){
     
     deque <peak> time_shift;    //see comments below
     
+        //####time sliced spectra, appended to measurements/slices.dat
+    spectrum_ring slices;
+    bool slicing=false;
+    
     AGC_reset_fifo(); 
     for(int i=0;;i++){
         if (!AGC_get_sample(&isalpha,&amplitude,&timestamp)){
-            // Stream to PC via TCP instead of saving to SD card
-            if (tcp_connected) {
-                time_in_seconds = timestamp/ 125000000.0; // Convert to seconds
-                
-                stringstream csv_line;
-                csv_line << std::fixed << std::setprecision(6);
-                
-                if (isalpha) {
-                    csv_line << time_in_seconds << "," 
-                            << (amplitude*0.0001220703125) << ","
-                            << "0,0\n";
-                } else {
-                    csv_line << "0,0," 
-                            << time_in_seconds << ","
-                            << (amplitude*0.0001220703125) << "\n";
-                }
-                
-                send_tcp_data(csv_line.str());
+            if (slice_uint && !slicing){    // first sample gives the unix time of FPGA timestamp 0
+                if (!slices.init("measurements/slices.dat","measurements/slices.idx",(int64_t)time(NULL)-(int64_t)(timestamp/125000000),
+                                 slice_uint,ENmax_alpha,ENmax_gamma))
+                    {printf("Could not open measurements/slices.dat or slices.idx. Time slicing disabled.\n"); slice_uint=0;}
+                else slicing=true;
             }
+            // Stream to PC via the spool, the sender thread does the TCP part
+            spool.push(timestamp,isalpha,amplitude);
 
             // Original processing continues unchanged
             time_shift.emplace_back();
@@ -465,25 +670,33 @@ int main(int argc,char *argv[]){
                 amplitude=time_shift.front().amp;
                 isalpha=time_shift.front().isalpha;
                 time_shift.pop_front();
+                int chan,bin;
                 if (isalpha){
                     N_alpha++;
-                    if (abs(amplitude-alpha_thresh)<ENmax_alpha)
-                        alpha_array[abs(amplitude-alpha_thresh)]++;    
+                    chan=alpha_lut->chan[amp_idx(amplitude)];
+                    bin=alpha_lut->bin[amp_idx(amplitude)];
+                    if (chan>=0)
+                        alpha_array[chan]++;    
                 }
                 else{
                     N_gamma++;
-                    if (abs(amplitude-gamma_thresh)<ENmax_gamma)
-                        gamma_array[abs(amplitude-gamma_thresh)]++;
+                    chan=gamma_lut->chan[amp_idx(amplitude)];
+                    bin=gamma_lut->bin[amp_idx(amplitude)];
+                    if (chan>=0)
+                        gamma_array[chan]++;
                 }
+                if (slicing) slices.add(timestamp,isalpha,chan);
                 
                 if (isalpha){
                     active_trig_alpha.emplace_back();
                     active_trig_alpha.back().time=timestamp;
                     active_trig_alpha.back().amp=amplitude;
+                    active_trig_alpha.back().bin=bin;
                 }else{
                     active_trig_gamma.emplace_back();
                     active_trig_gamma.back().time=timestamp;
                     active_trig_gamma.back().amp=amplitude;
+                    active_trig_gamma.back().bin=bin;
                 }
                 
                 if (!isalpha){
@@ -492,12 +705,10 @@ int main(int argc,char *argv[]){
                             active_trig_alpha.pop_front();
                             j--;
                         }else{
-                            unsigned a,b;
-                            a=abs(active_trig_alpha[j].amp-alpha_thresh)/step_alpha;
-                            b=abs(amplitude-gamma_thresh)/step_gamma;
+                            int a=active_trig_alpha[j].bin;
                             if ((interval_uint+(timestamp-active_trig_alpha[j].time))<2*interval_uint)
-                                if ((a<alpha_binN)&&(b<gamma_binN))
-                                    bins[a][b][interval_uint+(timestamp-active_trig_alpha[j].time)]++;
+                                if ((a>=0)&&(bin>=0))
+                                    bins[a][bin][interval_uint+(timestamp-active_trig_alpha[j].time)]++;
                         }
                     }    
                 }else{
@@ -506,12 +717,10 @@ int main(int argc,char *argv[]){
                             active_trig_gamma.pop_front();
                             j--;
                         }else{
-                            unsigned a,b;
-                            a=abs(amplitude-alpha_thresh)/step_alpha;
-                            b=abs(active_trig_gamma[j].amp-gamma_thresh)/step_gamma;
+                            int b=active_trig_gamma[j].bin;
                             if ((interval_uint-(timestamp-active_trig_gamma[j].time))<=interval_uint)
-                                if ((a<alpha_binN)&&(b<gamma_binN))
-                                    bins[a][b][interval_uint-(timestamp-active_trig_gamma[j].time)]++;
+                                if ((bin>=0)&&(b>=0))
+                                    bins[bin][b][interval_uint-(timestamp-active_trig_gamma[j].time)]++;
                         }
                     }    
                 }
@@ -530,6 +739,10 @@ int main(int argc,char *argv[]){
             if(pf)printf ("\033[2JPress 'e' to stop acquisition.\nN_alpha=%" PRIu64"\nN_gamma=%" PRIu64"\nelapsed time=%" PRIu64" s\n"
                           "TCP Connected: %s\nRPTY lost peaks:%" PRIu32"(max in queue %" PRIu16"/250)\n",
                           N_alpha,N_gamma,timestamp/125000000,tcp_connected?"YES":"NO",AGC_get_num_lost(),AGC_get_max_in_queue());
+            if(pf)printf ("Spool: %.2lf MB on disk (%.2lf MB/s write), %" PRIu64" events behind, catch-up %.0lf events/s, lost %" PRIu64"\n",
+                          spool.disk_bytes()/1048576.0,spool.write_us?spool.written_bytes/(double)spool.write_us:0.0,
+                          spool.head()-tcp_cursor,catchup_us?catchup_events*1e6/catchup_us:0.0,(uint64_t)spool.lost);
+            if(pf&&slicing)printf ("Spectrum slices saved:%u (writer stalls %u)\n",(unsigned)slices.flushed,slices.stalls);
             i=0;
         }
         
@@ -538,8 +751,24 @@ int main(int argc,char *argv[]){
     if(pf)printf ("\033[2JAcquisition ended.\nN_alpha=%" PRIu64"\nN_gamma=%" PRIu64"\nelapsed time=%" PRIu64" s\n"
                   "RPTY lost peaks:%" PRIu32"(max in queue %" PRIu16"/250)\n",N_alpha,N_gamma,timestamp/125000000,AGC_get_num_lost(),AGC_get_max_in_queue());
     
+    tcp_stop=true;
+    bool draining=tcp_connected;
+    if(pf&&draining)printf("Sending %" PRIu64" remaining events to PC...",spool.head()-tcp_cursor);
+    tcp_thread.join();
+    if(pf&&draining)printf("done!\n");
+    spool.finish();
+    if(pf&&spool.saved)printf("Spool: %" PRIu64" events not acknowledged by the PC saved in %s/, replay with agc_unspool.\n",
+                          (uint64_t)spool.saved,spool.rundir().c_str());
+    if(pf&&spool.lost)printf("Spool: %" PRIu64" events dropped before the PC acknowledged them (spool size limit or write errors).\n",(uint64_t)spool.lost);
+    
     FILE* ofile;
     
+    if (slicing){
+        if(pf)printf("Saving last spectrum slice...");
+        slices.finish(timestamp);
+        if(pf)printf("done! %u slices saved to measurements/slices.dat, index in slices.idx. Use agc_extract to sum a time range.\n",(unsigned)slices.flushed);
+    }
+    
     if(pf)printf("Saving alpha...");
     ofile=fopen("measurements/alpha.dat","wb");
     fwrite (alpha_array,sizeof(unsigned),ENmax_alpha,ofile);
@@ -568,6 +797,8 @@ int main(int argc,char *argv[]){
         delete[] bins[i];
     }
     delete[] bins;
+    delete alpha_lut;
+    delete gamma_lut;
     fclose(ofile);
     if(pf)printf("done! format is \'%%uint32\' and is a 3D matrix of size %d:%d:%d.\n ",alpha_binN,gamma_binN,2*interval_uint);
     
@@ -0,0 +1,99 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2025 TIFR
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Turns the events a run left in its spool folder (never acknowledged by the PC) back into the CSV of the TCP stream.
+// Usage: ./agc_unspool <spool run dir>
+// Output is unsent.csv in the run dir, the events not in any range of the "acked" file, in seq order. They are
+// missing from the file written by client_unified.py; merge the two by seq.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <dirent.h>
+#include <inttypes.h>
+#include "event_spool.h"
+
+using namespace std;
+
+struct chunk{
+    uint64_t first;
+    vector<spool_rec> recs;
+    bool operator<(const chunk& o) const {return first<o.first;}
+};
+
+int main(int argc,char *argv[]){
+    if (argc!=2){printf("Usage: %s <spool run dir>\n",argv[0]);return 1;}
+    string dir=argv[1];
+
+    map<uint64_t,uint64_t> acked;       //[first, second) already with the PC
+    unsigned long long a, b;
+    FILE* ifile=fopen((dir+"/acked").c_str(),"r");
+    if (ifile!=NULL){
+        while (fscanf(ifile,"%llu %llu",&a,&b)==2) acked[a]=b;
+        fclose(ifile);
+    }
+
+    DIR *d=opendir(dir.c_str());
+    if (d==NULL){printf("Could not open %s\n",dir.c_str());return 1;}
+    vector<chunk> chunks;
+    struct dirent *e;
+    while ((e=readdir(d))!=NULL){
+        string name=e->d_name;
+        if ((name.compare(0,6,"spool_")!=0)||(name.size()<10)||(name.compare(name.size()-4,4,".bin")!=0)) continue;
+        ifile=fopen((dir+"/"+name).c_str(),"rb");
+        if (ifile==NULL){printf("Could not open %s/%s\n",dir.c_str(),name.c_str());continue;}
+        uint32_t header[4];
+        while (fread(header,sizeof(uint32_t),4,ifile)==4){
+            chunks.push_back(chunk());
+            chunks.back().first=header[0]|((uint64_t)header[1]<<32);
+            chunks.back().recs.resize(header[2]);
+            size_t r=fread(chunks.back().recs.data(),sizeof(spool_rec),header[2],ifile);
+            chunks.back().recs.resize(r);       //a failed write leaves a partial last chunk
+            if (r!=header[2]) break;
+        }
+        fclose(ifile);
+    }
+    closedir(d);
+    sort(chunks.begin(),chunks.end());
+
+    FILE* ofile=fopen((dir+"/unsent.csv").c_str(),"w");
+    if (ofile==NULL){printf("Could not create %s/unsent.csv\n",dir.c_str());return 1;}
+    fprintf(ofile,"seq,time_alpha,amp_alpha,time_gamma,amp_gamma\n");
+    char line[64];
+    uint64_t next=0, n=0, first=0;
+    for (unsigned i=0;i!=chunks.size();i++){
+        for (unsigned k=0;k!=chunks[i].recs.size();k++){
+            uint64_t s=chunks[i].first+k;
+            if (n&&(s<next)) continue;
+            map<uint64_t,uint64_t>::iterator it=acked.upper_bound(s);
+            if ((it!=acked.begin())&&(prev(it)->second>s)) continue;
+            if (!n) first=s;
+            fwrite(line,1,spool_csv(line,s,&chunks[i].recs[k]),ofile);
+            next=s+1;
+            n++;
+        }
+    }
+    fclose(ofile);
+    printf("%" PRIu64" events written to %s/unsent.csv",n,dir.c_str());
+    if (n) printf(" (seq %" PRIu64" to %" PRIu64")",first,next-1);
+    printf("\n");
+    return 0;
+}
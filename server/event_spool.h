@@ -0,0 +1,392 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2025 TIFR
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef EVENT_SPOOL_H
+#define EVENT_SPOOL_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <deque>
+#include <map>
+#include <iterator>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ctime>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Store and forward buffer between the acquisition loop and the TCP sender.
+// Every event gets a sequence number (0 for the first event of a run). Events are kept in memory in chunks;
+// when a chunk leaves memory and the client has not acknowledged it yet, it is appended to the spool on SD or tmpfs.
+// The sender reads from wherever the sequence number currently lives, so a reconnecting client can resume
+// from its last received event while new events keep coming in.
+//
+// Acknowledgements are kept as ranges of seq: a client that starts LIVE after an outage acknowledges only what
+// it was sent, the backlog of the previous connection stays unacknowledged.
+//
+// Each run spools to its own folder <dir>/run_<unix time>/, files are spool_<first seq>.bin, each a series of chunks:
+// {uint64 first_seq, uint32 n, uint32 0} followed by n spool_rec. A file is deleted once the client has acknowledged
+// all of it, or (oldest first) above the size limit. At the end of a run everything not acknowledged is written out
+// and the acknowledged ranges are saved in the file "acked", one "<from> <to>" line per range [from, to);
+// agc_unspool turns the folder back into CSV. Folders of earlier runs are never touched.
+
+#define SPOOL_CHUNK_EVENTS 4096     //events per chunk, one sequential write each
+#define SPOOL_MEM_CHUNKS 64         //sealed chunks kept in memory, covers the time until the client acknowledges them
+#define SPOOL_MEM_MAX_CHUNKS 256    //hard limit (12 MB) while the spool cannot keep up, oldest chunks are dropped past it
+
+// 12 bytes per event, same layout as the FPGA registers: data is b30 : type (0 = alpha, 1 = gamma),
+// b29-16 : amplitude (14 bit signed)
+struct spool_rec{
+    uint32_t data;
+    uint32_t timestamp_l;
+    uint32_t timestamp_h;
+};
+
+inline void spool_encode(spool_rec *r, uint64_t timestamp, bool isalpha, int amplitude)
+{
+    r->data=(isalpha?0:0x40000000)|((amplitude&0x3FFF)<<16);
+    r->timestamp_l=(uint32_t)timestamp;
+    r->timestamp_h=(uint32_t)(timestamp>>32);
+}
+
+inline void spool_decode(const spool_rec *r, uint64_t *timestamp, bool *isalpha, int *amplitude)
+{
+    *isalpha=!(r->data&0x40000000);
+    *amplitude=(r->data&0x3FFF0000)>>16;
+    if (*amplitude&0x2000) *amplitude^=0xFFFFC000;
+    *timestamp=r->timestamp_l|((uint64_t)r->timestamp_h<<32);
+}
+
+// one line of the TCP stream: seq,time_alpha,amp_alpha,time_gamma,amp_gamma. Returns its length.
+inline int spool_csv(char *line, uint64_t seq, const spool_rec *r)
+{
+    uint64_t timestamp;
+    bool isalpha;
+    int amplitude;
+    spool_decode(r,&timestamp,&isalpha,&amplitude);
+    if (isalpha)
+        return sprintf(line,"%" PRIu64",%.6f,%.6f,0,0\n",seq,timestamp/125000000.0,amplitude*0.0001220703125);
+    return sprintf(line,"%" PRIu64",0,0,%.6f,%.6f\n",seq,timestamp/125000000.0,amplitude*0.0001220703125);
+}
+
+class event_spool{
+public:
+    bool init(const std::string& dir, uint64_t max_bytes)
+    {
+        _rundir=dir+"/run_"+std::to_string((long long)time(NULL));    //sequence numbers restart every run
+        _max_bytes=max_bytes;
+        _seg_bytes=max_bytes/8;
+        if (_seg_bytes<(1<<20)) _seg_bytes=1<<20;
+        std::string command="mkdir -p "+_rundir;
+        if (system(command.c_str())) return false;
+        _open=new std::vector<spool_rec>;
+        _open->reserve(SPOOL_CHUNK_EVENTS);
+        _open_first=0;
+        _head=0;
+        _acks.clear();
+        _disk_bytes=0;
+        _writing=false;
+        _stop=false;
+        written_bytes=0; write_us=0; lost=0; saved=0;
+        _spool_thread=std::thread(&event_spool::_spooler,this);
+        return true;
+    }
+
+    // acquisition thread, never waits on disk or network
+    inline void push(uint64_t timestamp, bool isalpha, int amplitude)
+    {
+        std::lock_guard<std::mutex> guard(_mx);
+        _open->emplace_back();
+        spool_encode(&_open->back(),timestamp,isalpha,amplitude);
+        _head++;
+        if (_open->size()==SPOOL_CHUNK_EVENTS){
+            _mem.push_back(_mem_chunk(_open_first,_open));
+            _open=new std::vector<spool_rec>;
+            _open->reserve(SPOOL_CHUNK_EVENTS);
+            _open_first=_head;
+            if (_mem.size()>SPOOL_MEM_MAX_CHUNKS){      //spool stuck: drop the oldest chunk it is not writing
+                std::deque<_mem_chunk>::iterator old=_mem.begin()+(_writing?1:0);
+                _count_lost(old->first,old->data->size());
+                delete old->data;
+                _mem.erase(old);
+            }
+            if (_mem.size()>SPOOL_MEM_CHUNKS) _cv.notify_all();
+        }
+    }
+
+    // copies up to max events starting at *seq. If *seq is no longer available (spool or memory limit), *seq is
+    // moved to the next available event. Returns 0 when there is nothing new.
+    unsigned read(uint64_t *seq, spool_rec *out, unsigned max)
+    {
+        std::unique_lock<std::mutex> lock(_mx);
+        if (*seq>=_head) return 0;
+        uint64_t mem_first=_mem.empty()?_open_first:_mem.front().first;
+        if (*seq<mem_first){
+            for (unsigned i=0;i!=_disk.size();i++){
+                const _disk_chunk &d=_disk[i];
+                if (*seq>=d.first+d.n) continue;
+                if (*seq<d.first) *seq=d.first;        //dropped by the size limit
+                std::shared_ptr<_segment> seg=d.seg;
+                unsigned skip=*seq-d.first;
+                unsigned n=std::min(max,d.n-skip);
+                off_t offset=d.offset+(off_t)skip*sizeof(spool_rec);
+                lock.unlock();                          //the segment stays open while we hold seg
+                ssize_t r=pread(seg->fd,out,n*sizeof(spool_rec),offset);
+                return (r>0)?r/sizeof(spool_rec):0;
+            }
+            *seq=mem_first;
+        }
+        for (unsigned i=0;i!=_mem.size();i++){
+            const _mem_chunk &m=_mem[i];
+            if (*seq>=m.first+m.data->size()) continue;
+            if (*seq<m.first) *seq=m.first;            //dropped by the memory limit
+            unsigned n=std::min<uint64_t>(max,m.first+m.data->size()-*seq);
+            std::copy(m.data->begin()+(*seq-m.first),m.data->begin()+(*seq-m.first)+n,out);
+            return n;
+        }
+        if (*seq<_open_first) *seq=_open_first;
+        unsigned n=std::min<uint64_t>(max,_head-*seq);
+        std::copy(_open->begin()+(*seq-_open_first),_open->begin()+(*seq-_open_first)+n,out);
+        return n;
+    }
+
+    // events [from, to) were acknowledged by the client, no need to spool them
+    void ack(uint64_t from, uint64_t to)
+    {
+        std::lock_guard<std::mutex> guard(_mx);
+        if (to>_head) to=_head;
+        if (from>=to) return;
+        std::map<uint64_t,uint64_t>::iterator it=_acks.upper_bound(from);
+        if ((it!=_acks.begin())&&(std::prev(it)->second>=from)){     //merge with touching ranges
+            --it;
+            from=it->first;
+        }
+        while ((it!=_acks.end())&&(it->first<=to)){
+            to=std::max(to,it->second);
+            it=_acks.erase(it);
+        }
+        _acks[from]=to;
+        if (_oldest_acked()) _cv.notify_all();      //spooler deletes the file
+    }
+
+    uint64_t head()
+    {
+        std::lock_guard<std::mutex> guard(_mx);
+        return _head;
+    }
+
+    uint64_t disk_bytes()
+    {
+        std::lock_guard<std::mutex> guard(_mx);
+        return _disk_bytes;
+    }
+
+    const std::string& rundir() {return _rundir;}
+
+    // writes every event not acknowledged yet to the spool, including the partial last chunk
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_mx);
+            _stop=true;
+        }
+        _cv.notify_all();
+        _spool_thread.join();
+        _disk.clear();
+        delete _open;
+    }
+
+    std::atomic<uint64_t> written_bytes;    //spooled to disk so far
+    std::atomic<uint64_t> write_us;         //time spent in those writes
+    std::atomic<uint64_t> lost;             //events dropped before the client acknowledged them
+    std::atomic<uint64_t> saved;            //after finish(): events left in rundir() for agc_unspool
+
+private:
+    struct _segment{
+        int fd;
+        std::string name;
+        uint64_t bytes;
+        ~_segment() {close(fd);}
+    };
+    struct _mem_chunk{
+        uint64_t first;
+        std::vector<spool_rec> *data;
+        _mem_chunk(uint64_t f, std::vector<spool_rec> *d) : first(f), data(d) {}
+    };
+    struct _disk_chunk{
+        uint64_t first;
+        unsigned n;
+        std::shared_ptr<_segment> seg;
+        off_t offset;       //of the first spool_rec
+    };
+
+    // events in [first, end) not acknowledged
+    uint64_t _unacked(uint64_t first, uint64_t end)
+    {
+        uint64_t n=end-first;
+        std::map<uint64_t,uint64_t>::iterator it=_acks.upper_bound(first);
+        if (it!=_acks.begin()) --it;
+        for (;(it!=_acks.end())&&(it->first<end);++it){
+            uint64_t a=std::max(first,it->first), b=std::min(end,it->second);
+            if (b>a) n-=b-a;
+        }
+        return n;
+    }
+
+    // [first, end) without its acknowledged head and tail, empty (*lo>=*hi) if all of it was acknowledged
+    void _unacked_span(uint64_t first, uint64_t end, uint64_t *lo, uint64_t *hi)
+    {
+        *lo=first; *hi=end;
+        std::map<uint64_t,uint64_t>::iterator it=_acks.upper_bound(first);
+        if ((it!=_acks.begin())&&(std::prev(it)->second>first)) *lo=std::prev(it)->second;
+        it=_acks.upper_bound(end-1);
+        if ((it!=_acks.begin())&&(std::prev(it)->second>=end)) *hi=std::prev(it)->first;
+    }
+
+    // only what the client has not acknowledged is lost, it already has the rest
+    void _count_lost(uint64_t first, uint64_t n)
+    {
+        lost+=_unacked(first,first+n);
+    }
+
+    // true when the client has acknowledged every chunk of the oldest spool file
+    bool _oldest_acked()
+    {
+        for (unsigned i=0;(i!=_disk.size())&&(_disk[i].seg==_disk[0].seg);i++)
+            if (_unacked(_disk[i].first,_disk[i].first+_disk[i].n)) return false;
+        return !_disk.empty();
+    }
+
+    void _drop_oldest()
+    {
+        std::shared_ptr<_segment> old=_disk.front().seg;
+        unlink(old->name.c_str());      //a reader holding old can still finish its pread
+        while (!_disk.empty()&&(_disk.front().seg==old)){
+            _count_lost(_disk.front().first,_disk.front().n);
+            _disk_bytes-=sizeof(uint32_t)*4+_disk.front().n*sizeof(spool_rec);
+            _disk.pop_front();
+        }
+    }
+
+    // writes the unacknowledged tail of the oldest memory chunk to the spool and frees it. Called with _mx locked.
+    void _spool_front(std::unique_lock<std::mutex>& lock, std::shared_ptr<_segment>& seg)
+    {
+        _mem_chunk m=_mem.front();      //stays readable in _mem while we write it
+        uint64_t from, end;
+        _unacked_span(m.first,m.first+m.data->size(),&from,&end);
+        _writing=true;
+        lock.unlock();
+
+        _disk_chunk d;
+        bool ok=true;
+        if (from<end){
+            if (!seg||(seg->bytes>=_seg_bytes)){
+                seg=std::make_shared<_segment>();
+                seg->name=_rundir+"/spool_"+std::to_string(from)+".bin";
+                seg->fd=open(seg->name.c_str(),O_RDWR|O_CREAT|O_TRUNC|O_APPEND,0644);
+                seg->bytes=0;
+            }
+            uint32_t header[4]={(uint32_t)from,(uint32_t)(from>>32),(uint32_t)(end-from),0};
+            size_t len=(end-from)*sizeof(spool_rec);
+            std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+            ssize_t r=-1;
+            if (seg->fd>=0&&(write(seg->fd,header,sizeof(header))==sizeof(header)))
+                r=write(seg->fd,m.data->data()+(from-m.first),len);
+            write_us+=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-t0).count();
+            ok=(r==(ssize_t)len);
+            if (ok){
+                d.first=from; d.n=end-from; d.seg=seg;
+                d.offset=seg->bytes+sizeof(header);
+                seg->bytes+=sizeof(header)+r;
+                written_bytes+=sizeof(header)+r;
+            }else if ((seg->fd<0)||ftruncate(seg->fd,seg->bytes)) seg.reset();    //cut off the partial chunk, or start over
+        }
+
+        lock.lock();
+        _writing=false;
+        if (!ok) _count_lost(from,end-from);        //SD full or gone, keep acquiring anyway
+        else if (from<end){
+            _disk.push_back(d);
+            _disk_bytes+=sizeof(uint32_t)*4+d.n*sizeof(spool_rec);
+            while ((_disk_bytes>_max_bytes)&&(_disk.front().seg!=seg)) _drop_oldest();
+        }
+        delete m.data;
+        _mem.pop_front();
+    }
+
+    // moves chunks out of memory and deletes spool files the client has caught up with
+    void _spooler()
+    {
+        std::shared_ptr<_segment> seg;
+        std::unique_lock<std::mutex> lock(_mx);
+        for (;;){
+            _cv.wait(lock,[this]{return (_mem.size()>SPOOL_MEM_CHUNKS)||_oldest_acked()||_stop;});
+            while (_oldest_acked()){
+                if (_disk.front().seg==seg) seg.reset();
+                _drop_oldest();
+            }
+            if (_stop) break;
+            while (_mem.size()>SPOOL_MEM_CHUNKS) _spool_front(lock,seg);
+        }
+
+        // end of run: nothing may stay in memory only
+        if (!_open->empty()){
+            _mem.push_back(_mem_chunk(_open_first,_open));
+            _open=new std::vector<spool_rec>;
+            _open_first=_head;
+        }
+        while (!_mem.empty()) _spool_front(lock,seg);
+        if (seg&&!seg->bytes) unlink(seg->name.c_str());        //every write to it failed
+        for (unsigned i=0;i!=_disk.size();i++) saved+=_unacked(_disk[i].first,_disk[i].first+_disk[i].n);
+        if (_disk.empty()) rmdir(_rundir.c_str());
+        else{
+            FILE *f=fopen((_rundir+"/acked").c_str(),"w");
+            if (f){
+                for (std::map<uint64_t,uint64_t>::iterator it=_acks.begin();it!=_acks.end();++it)
+                    fprintf(f,"%" PRIu64" %" PRIu64"\n",it->first,it->second);
+                fclose(f);
+            }
+        }
+    }
+
+    std::string _rundir;
+    uint64_t _max_bytes;
+    uint64_t _seg_bytes;
+    std::vector<spool_rec> *_open;      //chunk being filled by push()
+    uint64_t _open_first;
+    uint64_t _head;                     //sequence number of the next event
+    std::map<uint64_t,uint64_t> _acks;  //acknowledged ranges [first, second), disjoint and not touching
+    uint64_t _disk_bytes;
+    bool _writing;                      //the spooler is writing _mem.front() without the lock
+    bool _stop;
+    std::deque<_mem_chunk> _mem;
+    std::deque<_disk_chunk> _disk;
+    std::mutex _mx;
+    std::condition_variable _cv;
+    std::thread _spool_thread;
+};
+
+#endif
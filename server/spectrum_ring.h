@@ -0,0 +1,242 @@
+/*
+    Alpha Gamma Counter
+    Copyright (C) 2025 TIFR
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPECTRUM_RING_H
+#define SPECTRUM_RING_H
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// Time sliced alpha/gamma spectra. Both files are append only and shared by all runs in measurements/.
+// slices.dat : per slice, nz_alpha pairs then nz_gamma pairs of {uint32 channel, uint32 count},
+//              only nonzero channels are stored.
+// slices.idx : one slice_idx record per slice, written after its data. A stretch of slices without events gets
+//              a single record spanning it (t_end-t_start may be many slice lengths) with n_alpha=n_gamma=0,
+//              so gaps in the index only mean the server was not acquiring.
+// Absolute time of a slice start is run_t0 + t_start/125e6 (unix seconds).
+
+struct slice_idx{
+    int64_t run_t0;         //unix time of FPGA timestamp 0 for the run
+    uint64_t t_start;       //FPGA timestamp (8 ns steps) of slice start
+    uint64_t t_end;         //FPGA timestamp of slice end, shorter than slice length for the last one in a run
+    uint64_t offset;        //byte offset of slice data in slices.dat
+    uint32_t n_alpha;       //all alpha events in the slice, also those outside the spectrum
+    uint32_t n_gamma;
+    uint32_t nz_alpha;      //number of {channel, count} pairs stored
+    uint32_t nz_gamma;
+    uint32_t ENmax_alpha;   //spectrum lengths, same as alpha.dat/gamma.dat
+    uint32_t ENmax_gamma;
+};
+
+#define RING_SLOTS 4
+
+// The acquisition loop fills one slot while a writer thread flushes completed ones,
+// so SD card writes never stall the FPGA drain unless all slots are pending.
+class spectrum_ring{
+public:
+    bool init(const char *datname, const char *idxname, int64_t run_t0, uint64_t slice_uint, int ENmax_alpha, int ENmax_gamma)
+    {
+        _datfile=fopen(datname,"ab");
+        _idxfile=fopen(idxname,"ab");
+        if ((_datfile==NULL)||(_idxfile==NULL)) return false;
+        fseek(_datfile,0,SEEK_END);
+        _offset=ftell(_datfile);
+        _run_t0=run_t0;
+        _slice_uint=slice_uint;
+        _ENmax_alpha=ENmax_alpha;
+        _ENmax_gamma=ENmax_gamma;
+        for (int i=0;i!=RING_SLOTS;i++){
+            _slots[i].alpha=new uint32_t[ENmax_alpha];
+            _slots[i].gamma=new uint32_t[ENmax_gamma];
+            _slots[i].full=false;
+        }
+        _pairs=new uint32_t[2*(ENmax_alpha>ENmax_gamma?ENmax_alpha:ENmax_gamma)];
+        _head=0;
+        _started=false;
+        _stop=false;
+        flushed=0;
+        stalls=0;
+        _writer_thread=std::thread(&spectrum_ring::_writer,this);
+        return true;
+    }
+
+    // chan is the spectrum channel, -1 if the event falls outside the spectrum
+    inline void add(uint64_t timestamp, bool isalpha, int chan)
+    {
+        if (!_started||(timestamp>=_cur_end)) _rotate(timestamp);
+        slot &s=_slots[_head];
+        if (isalpha){
+            s.idx.n_alpha++;
+            if (chan>=0) s.alpha[chan]++;
+        }else{
+            s.idx.n_gamma++;
+            if (chan>=0) s.gamma[chan]++;
+        }
+    }
+
+    // flush the partial last slice and wait for the writer
+    void finish(uint64_t timestamp)
+    {
+        if (_started){
+            slice_idx &idx=_slots[_head].idx;
+            if ((timestamp>=idx.t_start)&&(timestamp<idx.t_end)) idx.t_end=timestamp;
+            _push();
+        }
+        {
+            std::lock_guard<std::mutex> guard(_mx);
+            _stop=true;
+        }
+        _cv.notify_all();
+        _writer_thread.join();
+        fclose(_datfile);
+        fclose(_idxfile);
+        for (int i=0;i!=RING_SLOTS;i++){
+            delete[] _slots[i].alpha;
+            delete[] _slots[i].gamma;
+        }
+        delete[] _pairs;
+    }
+
+    std::atomic<unsigned> flushed;      //slices written so far, read by the acquisition thread
+    unsigned stalls;                    //times the acquisition had to wait for the writer
+
+private:
+    struct slot{
+        slice_idx idx;
+        uint32_t *alpha;
+        uint32_t *gamma;
+        bool full;
+    };
+
+    void _push()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_mx);
+            _slots[_head].full=true;
+        }
+        _cv.notify_all();
+    }
+
+    // hand the current slot to the writer and move to the next free one
+    void _next()
+    {
+        _push();
+        _head=(_head+1)%RING_SLOTS;
+        std::unique_lock<std::mutex> lock(_mx);
+        if (_slots[_head].full){
+            stalls++;
+            _cv.wait(lock,[this]{return !_slots[_head].full;});
+        }
+    }
+
+    void _clear(uint64_t t_start)
+    {
+        slot &s=_slots[_head];
+        memset(s.alpha,0,_ENmax_alpha*sizeof(uint32_t));
+        memset(s.gamma,0,_ENmax_gamma*sizeof(uint32_t));
+        memset(&s.idx,0,sizeof(slice_idx));
+        s.idx.run_t0=_run_t0;
+        s.idx.t_start=t_start;
+        s.idx.t_end=t_start+_slice_uint;
+        s.idx.ENmax_alpha=_ENmax_alpha;
+        s.idx.ENmax_gamma=_ENmax_gamma;
+        _cur_end=s.idx.t_end;
+    }
+
+    void _rotate(uint64_t timestamp)
+    {
+        uint64_t t_start=timestamp-timestamp%_slice_uint;
+        if (!_started){
+            _started=true;
+            _clear(t_start);
+            return;
+        }
+        _next();
+        // one empty record for all slices without events, so a long quiet stretch costs two hand-offs at most
+        if (_cur_end<t_start){
+            _clear(_cur_end);
+            _slots[_head].idx.t_end=t_start;
+            _next();
+        }
+        _clear(t_start);
+    }
+
+    uint32_t _pack(const uint32_t *spectrum, int N)
+    {
+        uint32_t nz=0;
+        for (int i=0;i!=N;i++){
+            if (spectrum[i]){
+                _pairs[2*nz]=i;
+                _pairs[2*nz+1]=spectrum[i];
+                nz++;
+            }
+        }
+        fwrite(_pairs,sizeof(uint32_t),2*nz,_datfile);
+        return nz;
+    }
+
+    void _writer()
+    {
+        int tail=0;
+        for (;;){
+            {
+                std::unique_lock<std::mutex> lock(_mx);
+                _cv.wait(lock,[this,tail]{return _slots[tail].full||_stop;});
+                if (!_slots[tail].full) return;        //stopping and nothing left
+            }
+            slot &s=_slots[tail];
+            s.idx.offset=_offset;
+            s.idx.nz_alpha=_pack(s.alpha,_ENmax_alpha);
+            s.idx.nz_gamma=_pack(s.gamma,_ENmax_gamma);
+            _offset+=2*sizeof(uint32_t)*((uint64_t)s.idx.nz_alpha+s.idx.nz_gamma);
+            fflush(_datfile);
+            fwrite(&s.idx,sizeof(slice_idx),1,_idxfile);
+            fflush(_idxfile);
+            {
+                std::lock_guard<std::mutex> guard(_mx);
+                s.full=false;
+                flushed++;
+            }
+            _cv.notify_all();
+            tail=(tail+1)%RING_SLOTS;
+        }
+    }
+
+    slot _slots[RING_SLOTS];
+    int _head;
+    bool _started;
+    bool _stop;
+    uint64_t _cur_end;
+    uint64_t _slice_uint;
+    int64_t _run_t0;
+    int _ENmax_alpha;
+    int _ENmax_gamma;
+    uint64_t _offset;
+    uint32_t *_pairs;
+    FILE *_datfile;
+    FILE *_idxfile;
+    std::mutex _mx;
+    std::condition_variable _cv;
+    std::thread _writer_thread;
+};
+
+#endif